@@ -1,20 +1,98 @@
 #include "rbtree.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// batch 크기가 tree 크기의 1/RATIO 이상이면 한 번에 재구성
+#define RBTREE_BATCH_REBUILD_RATIO 8
+
+// RB tree의 높이는 2*log2(n+1) 이하이므로 64bit size_t에서 128이면 충분
+#define RBTREE_MAX_HEIGHT 128
+
+// 병렬 작업 시 thread 하나당 나눠줄 subtree 개수 (부하 분산용)
+#define RBTREE_TASKS_PER_THREAD 4
+
+static void *default_alloc(const size_t size, void *ctx) {
+  return malloc(size);
+}
+
+static void default_free(void *ptr, const size_t size, void *ctx) {
+  free(ptr);
+}
+
+static const rbtree_allocator_t default_allocator = {default_alloc, default_free, NULL};
 
 rbtree *new_rbtree(void) {
+  return new_rbtree_with_allocator(NULL);
+}
+
+rbtree *new_rbtree_with_allocator(const rbtree_allocator_t *allocator) {
 	// rbtree를 위한 메모리 할당
   // rbtree의 root와 nil 초기화
+  // tree 구조체와 nil도 같은 allocator에서 할당
+  if (allocator == NULL)
+    allocator = &default_allocator;
     
-	rbtree *p = (rbtree *)calloc(1, sizeof(rbtree));
-  node_t *nil = (node_t *)calloc(1, sizeof(node_t));
+	rbtree *p = (rbtree *)allocator->alloc(sizeof(rbtree), allocator->ctx);
+  if (p == NULL)
+    return NULL;
+  memset(p, 0, sizeof(rbtree));
+  p->allocator = *allocator;
+  p->node_size = sizeof(node_t);
+
+  node_t *nil = (node_t *)allocator->alloc(sizeof(node_t), allocator->ctx);
+  if (nil == NULL) {
+    allocator->free(p, sizeof(rbtree), allocator->ctx);
+    return NULL;
+  }
+  memset(nil, 0, sizeof(node_t));
   nil->color = RBTREE_BLACK;
 	
   p->root = nil;
   p->nil = nil;
+  p->head = nil;
+  p->tail = nil;
 
   return p;
 }
 
+static node_t *rbtree_alloc_node(rbtree *t) {
+  // 반납된 노드가 있으면 재사용하고 없으면 allocator에서 할당
+  node_t *node = t->free_list;
+
+  if (node != NULL) {
+    t->free_list = node->parent;
+    t->n_free--;
+  }
+  else {
+    node = (node_t *)t->allocator.alloc(t->node_size, t->allocator.ctx);
+    if (node == NULL)
+      return NULL;
+  }
+
+  memset(node, 0, t->node_size);
+  return node;
+}
+
+static void rbtree_release_node(rbtree *t, node_t *node) {
+  // 바로 해제하지 않고 free list에 보관. rbtree_shrink로 반환
+  node->parent = t->free_list;
+  t->free_list = node;
+  t->n_free++;
+}
+
+static void rbtree_free_tree(rbtree *t) {
+  // 노드가 모두 해제된 뒤 남은 free list, nil, tree 구조체 반환
+  rbtree_allocator_t allocator = t->allocator;
+
+  rbtree_shrink(t);
+  allocator.free(t->nil, sizeof(node_t), allocator.ctx);
+  allocator.free(t, sizeof(rbtree), allocator.ctx);
+}
+
 void delete_rbtree(rbtree *t) {
 	// root에서부터 삭제
   node_t *now = t->root;
@@ -24,8 +102,7 @@ void delete_rbtree(rbtree *t) {
   	
   // root는 delete_node 호출 시 메모리 해제 됨
   // rbtree의 nil은 따로 해제
-  free(t->nil);
-  free(t);
+  rbtree_free_tree(t);
 }
 
 void delete_node(rbtree *t, node_t *node) {
@@ -35,7 +112,54 @@ void delete_node(rbtree *t, node_t *node) {
     delete_node(t, node->right);
 	
   // 전부 찾아서 메모리 해제
-  free(node);
+  t->allocator.free(node, t->node_size, t->allocator.ctx);
+}
+
+static link_node_t *links(node_t *node) {
+  // threaded tree의 노드는 link_node_t로 할당되어 있음. nil은 제외
+  return (link_node_t *)node;
+}
+
+static void link_between(rbtree *t, node_t *node, node_t *prev, node_t *next) {
+  // prev와 next 사이에 node를 연결. 양 끝은 nil
+  links(node)->prev = prev;
+  links(node)->next = next;
+
+  if (prev == t->nil)
+    t->head = node;
+  else
+    links(prev)->next = node;
+
+  if (next == t->nil)
+    t->tail = node;
+  else
+    links(next)->prev = node;
+}
+
+static void unlink_node(rbtree *t, node_t *node) {
+  node_t *prev = links(node)->prev;
+  node_t *next = links(node)->next;
+
+  if (prev == t->nil)
+    t->head = next;
+  else
+    links(prev)->next = next;
+
+  if (next == t->nil)
+    t->tail = prev;
+  else
+    links(next)->prev = prev;
+}
+
+static void link_sorted(rbtree *t, node_t **nodes, const size_t n) {
+  // key 순서로 정렬된 노드 배열로 list 전체를 다시 연결
+  node_t *prev = t->nil;
+
+  t->head = t->tail = t->nil;
+  for (size_t i = 0; i < n; i++) {
+    link_between(t, nodes[i], prev, t->nil);
+    prev = nodes[i];
+  }
 }
 
 node_t *rbtree_insert(rbtree *t, const key_t key) {
@@ -45,17 +169,21 @@ node_t *rbtree_insert(rbtree *t, const key_t key) {
   node_t *p = t->nil;
 	  
   // 받은 키값을 가지는 노드 생성
-  node_t *node = (node_t *)calloc(1, sizeof(node_t));
+  node_t *node = rbtree_alloc_node(t);
+  if (node == NULL)
+    return NULL;
   node->key = key;
   
   // 삽입될 적절한 위치 찾기
+  // 분기 예측이 다음 노드 load를 앞당기도록 일부러 분기로 둠
+  // (비교 결과로 인덱싱하는 분기 없는 버전은 load가 직렬화되어 더 느림)
   while (now != t->nil){
     p = now;
-        
-    if (node->key < now->key)
-      	now = now->left;
+
+    if (key < now->key)
+      now = now->left;
     else
-      	now = now->right;
+      now = now->right;
   }
   // node의 부모를 p로 설정
   node->parent = p;
@@ -63,14 +191,26 @@ node_t *rbtree_insert(rbtree *t, const key_t key) {
   if (p == t->nil)
     t->root = node;
   // p의 자식을 node로 설정
-  else if (node->key < p->key)
-    p->left = node;
   else
-    p->right = node;
+    p->child[key >= p->key] = node;
 
   node->left = t->nil;
   node->right = t->nil;
   node->color = RBTREE_RED;
+  t->size++;
+
+  // threaded 모드면 부모 기준으로 앞뒤 노드를 O(1)에 찾아 끼워넣음
+  if (t->threaded) {
+    if (p == t->nil)
+      link_between(t, node, t->nil, t->nil);
+    else if (node == p->left)
+      link_between(t, node, links(p)->prev, p);
+    else
+      link_between(t, node, p, links(p)->next);
+  }
+
+  // 새 노드부터 root까지 aggregate 갱신
+  rbtree_augment_path(t, node);
 	
   // 룰 위반여부 검사
   rbtree_insert_fixup(t, node);
@@ -78,104 +218,192 @@ node_t *rbtree_insert(rbtree *t, const key_t key) {
   return node;
 }
 
+static int key_comp(const void *p1, const void *p2) {
+  const key_t a = *(const key_t *)p1;
+  const key_t b = *(const key_t *)p2;
+
+  return (a > b) - (a < b);
+}
+
+static void collect_nodes(const rbtree *t, node_t *now, node_t **nodes, size_t *idx) {
+  // 중위순회로 노드 포인터를 key 순서대로 모음
+  if (now == t->nil)
+    return;
+
+  collect_nodes(t, now->left, nodes, idx);
+  nodes[(*idx)++] = now;
+  collect_nodes(t, now->right, nodes, idx);
+}
+
+static node_t *build_balanced(rbtree *t, node_t **nodes, size_t lo, size_t hi,
+                              int depth, int red_depth, node_t *parent) {
+  // 정렬된 노드 배열의 가운데를 root로 삼아 재귀적으로 연결
+  // 꽉 찬 level 아래에 매달린 마지막 level만 RED로 칠하면
+  // 모든 경로의 BLACK 개수가 red_depth로 같아짐
+  if (lo >= hi)
+    return t->nil;
+
+  size_t mid = lo + (hi - lo) / 2;
+  node_t *node = nodes[mid];
+
+  node->parent = parent;
+  node->left = build_balanced(t, nodes, lo, mid, depth + 1, red_depth, node);
+  node->right = build_balanced(t, nodes, mid + 1, hi, depth + 1, red_depth, node);
+  node->color = depth >= red_depth ? RBTREE_RED : RBTREE_BLACK;
+  rbtree_augment_node(t, node);
+
+  return node;
+}
+
+static int full_levels(const size_t n) {
+  // 노드 n개로 꽉 채울 수 있는 level 수 (2^L - 1 <= n 인 최대 L)
+  int levels = 0;
+
+  while (((size_t)1 << (levels + 1)) - 1 <= n)
+    levels++;
+
+  return levels;
+}
+
+static int rebuild_with(rbtree *t, const key_t *sorted, const size_t n) {
+  size_t total = t->size + n;
+  node_t **nodes = (node_t **)malloc(total * sizeof(node_t *));
+  size_t idx = 0;
+
+  if (nodes == NULL)
+    return -1;
+
+  // 기존 노드는 재사용하고 앞쪽에 모음
+  collect_nodes(t, t->root, nodes, &idx);
+
+  // 새 노드는 병합 도중 실패하지 않도록 미리 확보
+  if (rbtree_reserve(t, n) != 0) {
+    free(nodes);
+    return -1;
+  }
+
+  // 뒤에서부터 병합하면 추가 배열 없이 제자리 병합 가능
+  size_t i = t->size, j = n, k = total;
+  while (j > 0) {
+    if (i > 0 && nodes[i - 1]->key > sorted[j - 1]) {
+      nodes[--k] = nodes[--i];
+    }
+    else {
+      node_t *node = rbtree_alloc_node(t);
+      node->key = sorted[--j];
+      nodes[--k] = node;
+    }
+  }
+
+  t->root = build_balanced(t, nodes, 0, total, 0, full_levels(total), t->nil);
+  t->root->color = RBTREE_BLACK;
+  t->size = total;
+  if (t->threaded)
+    link_sorted(t, nodes, total);
+
+  free(nodes);
+  return 0;
+}
+
+int rbtree_insert_batch(rbtree *t, const key_t *keys, const size_t n) {
+  if (n == 0)
+    return 0;
+
+  // 입력은 건드리지 않고 복사본을 정렬
+  key_t *sorted = (key_t *)malloc(n * sizeof(key_t));
+  if (sorted == NULL)
+    return -1;
+
+  for (size_t i = 0; i < n; i++)
+    sorted[i] = keys[i];
+  qsort(sorted, n, sizeof(key_t), key_comp);
+
+  // tree에 비해 batch가 크면 O(size + n)에 통째로 재구성
+  // 작으면 정렬된 순서로 삽입해서 탐색 경로의 cache 재사용
+  int ret = 0;
+  if (n >= t->size / RBTREE_BATCH_REBUILD_RATIO) {
+    ret = rebuild_with(t, sorted, n);
+  }
+  // 노드를 미리 확보해서 중간에 일부만 들어가는 일이 없게 함
+  else if (rbtree_reserve(t, n) != 0) {
+    ret = -1;
+  }
+  else {
+    for (size_t i = 0; i < n; i++)
+      rbtree_insert(t, sorted[i]);
+  }
+
+  free(sorted);
+  return ret;
+}
+
 void rbtree_insert_fixup(rbtree *t, node_t *node) {
 	// #4 위반 시 무한반복
 	while (node->parent->color == RBTREE_RED) {
-    // 할아버지 기준 좌측영역
-    if (node->parent == node->parent->parent->left) {
-      node_t *p_bro = node->parent->parent->right;
-      // case.1 부모의 형제가 RED일 때
-      if (p_bro->color == RBTREE_RED) {
-        // 할아버지 BLACK과 부모라인 RED 교환
-        node->parent->color = RBTREE_BLACK;
-        p_bro->color = RBTREE_BLACK; 
-        node->parent->parent->color = RBTREE_RED;
-        // 할아버지 기준으로 #4 위반하는지 재검사
-        node = node->parent->parent;
-      }
-      // case.2, case.3 부모의 형제가 BLACK일 때
-      else {
-        // case.2 꺾인 형태일 때
-        if (node == node->parent->right) {
-          // 회전 후 case.3으로 만듦
-          node = node->parent;
-          rbtree_left_rotate(t, node);
-        }
-				// case.3 뻗은 형태일 때
-        // 할아버지 BLACK과 부모의 RED 교환 후 회전
-        node->parent->color = RBTREE_BLACK;
-        node->parent->parent->color = RBTREE_RED;
-        rbtree_right_rotate(t, node->parent->parent);
-      }
+    node_t *grand = node->parent->parent;
+    // 부모가 할아버지의 어느 쪽인지. 좌우 대칭은 dir로 처리
+    int dir = node->parent != grand->left;
+    node_t *p_bro = grand->child[!dir];
+
+    // case.1 부모의 형제가 RED일 때
+    if (p_bro->color == RBTREE_RED) {
+      // 할아버지 BLACK과 부모라인 RED 교환
+      node->parent->color = RBTREE_BLACK;
+      p_bro->color = RBTREE_BLACK;
+      grand->color = RBTREE_RED;
+      // 할아버지 기준으로 #4 위반하는지 재검사
+      node = grand;
     }
-    // 할아버지 기준 우측영역. 좌측영역의 대칭과 동일
+    // case.2, case.3 부모의 형제가 BLACK일 때
     else {
-      node_t *p_bro = node->parent->parent->left;
-
-      if (p_bro->color == RBTREE_RED) {
-        node->parent->color = RBTREE_BLACK;
-        p_bro->color = RBTREE_BLACK; 
-        node->parent->parent->color = RBTREE_RED;
-        node = node->parent->parent;
-      }
-      else {
-        if (node == node->parent->left) {
-          node = node->parent;
-          rbtree_right_rotate(t, node);
-        }
-
-        node->parent->color = RBTREE_BLACK;
-        node->parent->parent->color = RBTREE_RED;
-        rbtree_left_rotate(t, node->parent->parent);
+      // case.2 꺾인 형태일 때
+      if (node == node->parent->child[!dir]) {
+        // 회전 후 case.3으로 만듦
+        node = node->parent;
+        rbtree_rotate(t, node, dir);
       }
+      // case.3 뻗은 형태일 때
+      // 할아버지 BLACK과 부모의 RED 교환 후 회전
+      node->parent->color = RBTREE_BLACK;
+      grand->color = RBTREE_RED;
+      rbtree_rotate(t, grand, !dir);
     }
 	}
   // #2를 위반 시 BLACK으로 바꿔주면 해결
   t->root->color = RBTREE_BLACK;
 }
 
-void rbtree_left_rotate(rbtree *t, node_t *node) {
-  node_t *tmp = node->right;
+void rbtree_rotate(rbtree *t, node_t *node, const dir_t dir) {
+  // node가 dir 방향 아래로 내려가고 반대쪽 자식 tmp가 올라옴
+  node_t *tmp = node->child[!dir];
 
-  // node와 tmp->left 상호연결
-  node->right = tmp->left;
-  if (tmp->left != t->nil)
-    tmp->left->parent = node;
+  // node와 tmp->child[dir] 상호연결
+  node->child[!dir] = tmp->child[dir];
+  if (tmp->child[dir] != t->nil)
+    tmp->child[dir]->parent = node;
 
   // tmp와 node->parent 상호연결
   tmp->parent = node->parent;
   if (node->parent == t->nil)
     t->root = tmp;
-  else if (node == node->parent->left)
-    node->parent->left = tmp;
   else
-    node->parent->right = tmp;
+    node->parent->child[node != node->parent->left] = tmp;
 
   // tmp와 node 상호연결
-  tmp->left = node;
+  tmp->child[dir] = node;
   node->parent = tmp;
-}
-
-void rbtree_right_rotate(rbtree *t, node_t *node) {
-  node_t *tmp = node->left;
 
-  // node와 tmp->right 상호연결
-  node->left = tmp->right;
-  if (tmp->right != t->nil)
-    tmp->right->parent = node;
+  // 자식이 된 node부터 aggregate 재계산
+  rbtree_augment_node(t, node);
+  rbtree_augment_node(t, tmp);
+}
 
-  // tmp와 node->parent 상호연결
-  tmp->parent = node->parent;
-  if (node->parent == t->nil)
-    t->root = tmp;
-  else if (node == node->parent->left)
-    node->parent->left = tmp;
-  else
-    node->parent->right = tmp;
+void rbtree_left_rotate(rbtree *t, node_t *node) {
+  rbtree_rotate(t, node, RBTREE_LEFT);
+}
 
-  // tmp와 node 상호연결
-  tmp->right = node;
-  node->parent = tmp;
+void rbtree_right_rotate(rbtree *t, node_t *node) {
+  rbtree_rotate(t, node, RBTREE_RIGHT);
 }
 
 node_t *rbtree_find(const rbtree *t, const key_t key) {
@@ -196,6 +424,9 @@ node_t *rbtree_find(const rbtree *t, const key_t key) {
 node_t *rbtree_min(const rbtree *t) {
   node_t *now = t->root;
 
+  if (t->threaded)
+    return t->head;
+
   while (now->left != t->nil)
     now = now->left;
   
@@ -212,12 +443,120 @@ node_t *rbtree_successor(const rbtree *t, node_t *pivot) {
 node_t *rbtree_max(const rbtree *t) {
   node_t *now = t->root;
 
+  if (t->threaded)
+    return t->tail;
+
   while (now->right != t->nil)
     now = now->right;
   
   return now;
 }
 
+node_t *rbtree_next(const rbtree *t, node_t *node) {
+  // 중위순회 기준 다음 노드. 없으면 NULL
+  if (t->threaded)
+    return links(node)->next == t->nil ? NULL : links(node)->next;
+
+  // 오른쪽 subtree가 있으면 그 최솟값
+  if (node->right != t->nil)
+    return rbtree_successor(t, node->right);
+
+  // 없으면 왼쪽 자식으로 올라오는 첫 조상
+  node_t *p = node->parent;
+  while (p != t->nil && node == p->right) {
+    node = p;
+    p = p->parent;
+  }
+
+  return p == t->nil ? NULL : p;
+}
+
+node_t *rbtree_prev(const rbtree *t, node_t *node) {
+  // 중위순회 기준 이전 노드. rbtree_next의 대칭
+  if (t->threaded)
+    return links(node)->prev == t->nil ? NULL : links(node)->prev;
+
+  if (node->left != t->nil) {
+    node = node->left;
+    while (node->right != t->nil)
+      node = node->right;
+    return node;
+  }
+
+  node_t *p = node->parent;
+  while (p != t->nil && node == p->left) {
+    node = p;
+    p = p->parent;
+  }
+
+  return p == t->nil ? NULL : p;
+}
+
+static int relayout_nodes(rbtree *t, const size_t node_size) {
+  // 노드 크기가 바뀌면 새 크기의 노드로 옮겨 균형 tree로 다시 연결
+  // 기존 노드 포인터는 모두 무효가 됨
+  size_t n = t->size, idx = 0;
+  node_t **nodes = (node_t **)malloc((n + 1) * sizeof(node_t *));
+  node_t **fresh = (node_t **)malloc((n + 1) * sizeof(node_t *));
+
+  if (nodes == NULL || fresh == NULL) {
+    free(nodes);
+    free(fresh);
+    return -1;
+  }
+
+  // 새 노드를 먼저 전부 할당해서 실패하면 tree를 그대로 둠
+  for (size_t i = 0; i < n; i++) {
+    fresh[i] = (node_t *)t->allocator.alloc(node_size, t->allocator.ctx);
+    if (fresh[i] == NULL) {
+      while (i > 0)
+        t->allocator.free(fresh[--i], node_size, t->allocator.ctx);
+      free(nodes);
+      free(fresh);
+      return -1;
+    }
+  }
+
+  collect_nodes(t, t->root, nodes, &idx);
+  for (size_t i = 0; i < n; i++) {
+    memset(fresh[i], 0, node_size);
+    fresh[i]->key = nodes[i]->key;
+    t->allocator.free(nodes[i], t->node_size, t->allocator.ctx);
+  }
+
+  // free list의 노드는 이전 크기이므로 반환
+  rbtree_shrink(t);
+  t->node_size = node_size;
+  t->root = build_balanced(t, fresh, 0, n, 0, full_levels(n), t->nil);
+  t->root->color = RBTREE_BLACK;
+
+  free(nodes);
+  free(fresh);
+  return 0;
+}
+
+int rbtree_set_threaded(rbtree *t, const int threaded) {
+  // link가 필요한 모드에서만 큰 노드를 쓰도록 노드 크기를 맞춤
+  const size_t node_size = threaded ? sizeof(link_node_t) : sizeof(node_t);
+
+  if (node_size != t->node_size && relayout_nodes(t, node_size) != 0)
+    return -1;
+
+  // 켤 때 한 번 중위순회로 list를 만들고 이후로는 insert/erase에서 유지
+  if (threaded && !t->threaded) {
+    node_t *prev = t->nil;
+    node_t *now = t->root == t->nil ? NULL : rbtree_min(t);
+
+    t->head = t->tail = t->nil;
+    for (; now != NULL; now = rbtree_next(t, now)) {
+      link_between(t, now, prev, t->nil);
+      prev = now;
+    }
+  }
+  t->threaded = threaded;
+  return 0;
+}
+
 int rbtree_erase(rbtree *t, node_t *origin) {
 	// 현재 target은 원래 삭제하려던 노드 origin
   node_t *target = origin;
@@ -240,7 +579,7 @@ int rbtree_erase(rbtree *t, node_t *origin) {
   // 자식이 2개
   else {
     // target이 successor로 바뀜
-    target = rbtree_successor(t, target->right);
+    target = t->threaded ? links(origin)->next : rbtree_successor(t, target->right);
     erased_color = target->color;
     erased_sub_node = target->right;
   
@@ -253,13 +592,20 @@ int rbtree_erase(rbtree *t, node_t *origin) {
     target->left->parent = target;
     target->color = origin->color;
   }
+  // 구조가 바뀐 지점부터 root까지 aggregate 갱신
+  // fixup의 회전은 rotate에서 스스로 갱신함
+  rbtree_augment_path(t, erased_sub_node->parent);
+
   // 삭제되는 색이 BLACK이라면 extra black을 처리해줄 추가작업
   if (erased_color == RBTREE_BLACK)
     rbtree_erase_fixup(t, erased_sub_node);
   
   // 삭제되는거는 target의 색인거지 target 노드가 아님
   // 삭제되는 노드는 origin임
-  free(origin);
+  if (t->threaded)
+    unlink_node(t, origin);
+  rbtree_release_node(t, origin);
+  t->size--;
 
   return 0;
 }
@@ -268,81 +614,50 @@ void rbtree_erase_fixup(rbtree *t, node_t *node) {
 	// doubly black이면 무한반복
   // doubly black인데 root이면 탈출
   while (node != t->root && node->color == RBTREE_BLACK) {
-    // 좌측영역
-    if (node == node->parent->left) {
-      node_t *bro = node->parent->right;
-
-      // case.1 형제가 RED일 때
-      if (bro->color == RBTREE_RED) {
-        // 부모 BLACK과 형제 RED 교환 후 회전
-        // case.2, case.3, case.4으로 변환
-        bro->color = RBTREE_BLACK;
-        node->parent->color = RBTREE_RED;
-        rbtree_left_rotate(t, node->parent);
-        bro = node->parent->right;
-      }
-    
-      // case.2, case.3, case.4 형제가 BLACK일 때
-          
-      // case.2 형제의 자식 모두 BLACK일 때
-      if (bro->left->color == RBTREE_BLACK && bro->right->color == RBTREE_BLACK) {
-        // 공통속성 나의 extra black과 형제의 BLACK을 부모에게 옮김
-        bro->color = RBTREE_RED;
-        // 부모가 extra black을 받았으니 재검사
-        node = node->parent;
-      }
-      else {
-        // case.3 형제의 왼쪽만 RED일 때
-        if (bro->left->color == RBTREE_RED) {
-          // 형제의 BLACK과 형제자식의 RED 교환 후 회전
-          //case.4로 변환
-          bro->left->color = RBTREE_BLACK;
-          bro->color = RBTREE_RED;
-          rbtree_right_rotate(t, bro);
-          bro = node->parent->right;
-        }
-        // case. 4
-        // 형제의 색을 부모의 색으로
-        // 부모와 형제의 RED자식을 BLACK으로
-        // 부모 기준 회전
-        bro->color = node->parent->color;
-        node->parent->color = RBTREE_BLACK;
-        bro->right->color = RBTREE_BLACK;
-        rbtree_left_rotate(t, node->parent);
-            
-        // case.4를 해결 시 탈출을 위한 root로 초기화
-        node = t->root;
-      }
+    // node가 부모의 어느 쪽인지. 좌우 대칭은 dir로 처리
+    int dir = node != node->parent->left;
+    node_t *bro = node->parent->child[!dir];
+
+    // case.1 형제가 RED일 때
+    if (bro->color == RBTREE_RED) {
+      // 부모 BLACK과 형제 RED 교환 후 회전
+      // case.2, case.3, case.4으로 변환
+      bro->color = RBTREE_BLACK;
+      node->parent->color = RBTREE_RED;
+      rbtree_rotate(t, node->parent, dir);
+      bro = node->parent->child[!dir];
     }
-    // 우측영역. 좌측영역의 대칭과 동일
-    else {
-      node_t *bro = node->parent->left;
 
-      if (bro->color == RBTREE_RED) {
-        bro->color = RBTREE_BLACK;
-        node->parent->color = RBTREE_RED;
-        rbtree_right_rotate(t, node->parent);
-        bro = node->parent->left;
-      }
+    // case.2, case.3, case.4 형제가 BLACK일 때
 
-      if (bro->left->color == RBTREE_BLACK && bro->right->color == RBTREE_BLACK) {
+    // case.2 형제의 자식 모두 BLACK일 때
+    if (bro->left->color == RBTREE_BLACK && bro->right->color == RBTREE_BLACK) {
+      // 공통속성 나의 extra black과 형제의 BLACK을 부모에게 옮김
+      bro->color = RBTREE_RED;
+      // 부모가 extra black을 받았으니 재검사
+      node = node->parent;
+    }
+    else {
+      // case.3 형제의 먼 쪽 자식이 BLACK일 때 (가까운 쪽만 RED)
+      if (bro->child[!dir]->color == RBTREE_BLACK) {
+        // 형제의 BLACK과 형제자식의 RED 교환 후 회전
+        // case.4로 변환
+        bro->child[dir]->color = RBTREE_BLACK;
         bro->color = RBTREE_RED;
-        node = node->parent;
-      }
-      else {
-        if (bro->right->color == RBTREE_RED) {
-          bro->right->color = RBTREE_BLACK;
-          bro->color = RBTREE_RED;
-          rbtree_left_rotate(t, bro);
-          bro = node->parent->left;
-        }
-
-        bro->color = node->parent->color;
-        node->parent->color = RBTREE_BLACK;
-        bro->left->color = RBTREE_BLACK;
-        rbtree_right_rotate(t, node->parent);
-        node = t->root;
+        rbtree_rotate(t, bro, !dir);
+        bro = node->parent->child[!dir];
       }
+      // case. 4
+      // 형제의 색을 부모의 색으로
+      // 부모와 형제의 RED자식을 BLACK으로
+      // 부모 기준 회전
+      bro->color = node->parent->color;
+      node->parent->color = RBTREE_BLACK;
+      bro->child[!dir]->color = RBTREE_BLACK;
+      rbtree_rotate(t, node->parent, dir);
+
+      // case.4를 해결 시 탈출을 위한 root로 초기화
+      node = t->root;
     }
   }
   node->color = RBTREE_BLACK;
@@ -353,10 +668,8 @@ void rbtree_transplant(rbtree *t, node_t *empty, node_t *replace) {
     
   if (empty->parent == t->nil)
     t->root = replace;
-  else if (empty == empty->parent->left)
-    empty->parent->left = replace;
   else
-    empty->parent->right = replace;
+    empty->parent->child[empty != empty->parent->left] = replace;
 
   replace->parent = empty->parent;
 }
@@ -366,6 +679,8 @@ int rbtree_to_array(const rbtree *t, key_t *arr, const size_t n) {
   if (t->root == t->nil)
     return -1;
 
+  // threaded 모드여도 list를 따라가면 load가 한 줄로 이어져 더 느림
+  // 중위순회는 부모로 돌아오는 이동이 cache hit이라 그대로 사용
   int idx = 0;
   rbtree_in_order(t, t->root, arr, &idx);
 
@@ -382,4 +697,499 @@ void rbtree_in_order(const rbtree *t, node_t *now, key_t *arr, int *idx) {
 
   if (now->right != t->nil)
     rbtree_in_order(t, now->right, arr, idx);
-}
\ No newline at end of file
+}
+
+static agg_t monoid_lift_key(const node_t *node) {
+  return node->key;
+}
+
+static agg_t monoid_add(const agg_t a, const agg_t b) {
+  return a + b;
+}
+
+static agg_t monoid_min(const agg_t a, const agg_t b) {
+  return a < b ? a : b;
+}
+
+static agg_t monoid_max(const agg_t a, const agg_t b) {
+  return a > b ? a : b;
+}
+
+const rbtree_monoid_t rbtree_monoid_sum = {0, monoid_lift_key, monoid_add};
+const rbtree_monoid_t rbtree_monoid_min = {LLONG_MAX, monoid_lift_key, monoid_min};
+const rbtree_monoid_t rbtree_monoid_max = {LLONG_MIN, monoid_lift_key, monoid_max};
+
+static void augment_subtree(const rbtree *t, node_t *now) {
+  // 후위순회로 자식부터 계산
+  if (now == t->nil)
+    return;
+
+  augment_subtree(t, now->left);
+  augment_subtree(t, now->right);
+  rbtree_augment_node(t, now);
+}
+
+void rbtree_set_monoid(rbtree *t, const rbtree_monoid_t *monoid) {
+  // monoid가 바뀌면 이미 들어있는 노드 전부 재계산
+  t->monoid = monoid;
+  if (monoid == NULL)
+    return;
+
+  // nil은 항등원을 가져야 자식 유무와 상관없이 combine 가능
+  t->nil->agg = monoid->identity;
+  augment_subtree(t, t->root);
+}
+
+void rbtree_augment_node(const rbtree *t, node_t *node) {
+  // 왼쪽 subtree, 자기 자신, 오른쪽 subtree 순서로 결합
+  const rbtree_monoid_t *m = t->monoid;
+
+  if (m == NULL || node == t->nil)
+    return;
+
+  node->agg = m->combine(m->combine(node->left->agg, m->lift(node)), node->right->agg);
+}
+
+void rbtree_augment_path(const rbtree *t, node_t *node) {
+  if (t->monoid == NULL)
+    return;
+
+  while (node != t->nil) {
+    rbtree_augment_node(t, node);
+    node = node->parent;
+  }
+}
+
+agg_t rbtree_range_aggregate(const rbtree *t, const key_t lo, const key_t hi) {
+  // [lo, hi) 범위의 key들을 key 순서대로 결합
+  const rbtree_monoid_t *m = t->monoid;
+  node_t *now = t->root;
+
+  if (m == NULL)
+    return 0;
+
+  // lo <= key < hi 인 첫 노드(분기점)까지 내려감
+  while (now != t->nil && (now->key < lo || now->key >= hi)) {
+    if (now->key < lo)
+      now = now->right;
+    else
+      now = now->left;
+  }
+  if (now == t->nil)
+    return m->identity;
+
+  // 분기점의 왼쪽: key >= lo 인 부분. 뒤에 찾은 것이 더 작은 key
+  agg_t left = m->identity;
+  node_t *l = now->left;
+  while (l != t->nil) {
+    if (l->key >= lo) {
+      left = m->combine(m->combine(m->lift(l), l->right->agg), left);
+      l = l->left;
+    }
+    else
+      l = l->right;
+  }
+
+  // 분기점의 오른쪽: key < hi 인 부분. 뒤에 찾은 것이 더 큰 key
+  agg_t right = m->identity;
+  node_t *r = now->right;
+  while (r != t->nil) {
+    if (r->key < hi) {
+      right = m->combine(right, m->combine(r->left->agg, m->lift(r)));
+      r = r->right;
+    }
+    else
+      r = r->left;
+  }
+
+  return m->combine(m->combine(left, m->lift(now)), right);
+}
+
+// 병렬 작업 실행기: task 번호를 atomic counter로 나눠가짐
+typedef struct {
+  void (*fn)(void *, size_t);
+  void *ctx;
+  size_t n_tasks;
+  atomic_size_t next;
+} par_job_t;
+
+static void *par_worker(void *arg) {
+  par_job_t *job = (par_job_t *)arg;
+  size_t i;
+
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->n_tasks)
+    job->fn(job->ctx, i);
+
+  return NULL;
+}
+
+static int par_threads(int nthreads) {
+  // 0 이하이면 online core 개수 사용
+  if (nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+  return nthreads < 1 ? 1 : nthreads;
+}
+
+static void run_parallel(int nthreads, size_t n_tasks, void (*fn)(void *, size_t), void *ctx) {
+  par_job_t job = {fn, ctx, n_tasks, 0};
+  pthread_t *tids = NULL;
+  int spawned = 0;
+
+  if (nthreads > 1)
+    tids = (pthread_t *)malloc((nthreads - 1) * sizeof(pthread_t));
+
+  // thread 생성에 실패해도 호출한 thread가 남은 task를 전부 처리함
+  if (tids != NULL) {
+    for (; spawned < nthreads - 1; spawned++) {
+      if (pthread_create(&tids[spawned], NULL, par_worker, &job) != 0)
+        break;
+    }
+  }
+  par_worker(&job);
+
+  for (int i = 0; i < spawned; i++)
+    pthread_join(tids[i], NULL);
+  free(tids);
+}
+
+static int split_depth(int nthreads) {
+  // 나눠질 subtree 개수(2^depth)가 thread당 task 개수를 넘도록 depth 결정
+  int depth = 0;
+
+  while (((size_t)1 << depth) < (size_t)nthreads * RBTREE_TASKS_PER_THREAD)
+    depth++;
+
+  return depth;
+}
+
+// subtree 단위 task. whole이 0이면 위쪽 level의 노드 하나만 의미
+typedef struct {
+  node_t *node;
+  int whole;
+  size_t off, len;
+} subtree_task_t;
+
+static size_t split_subtrees(const rbtree *t, node_t *now, int depth, subtree_task_t *tasks, size_t idx) {
+  // depth만큼 내려간 subtree들과 그 위의 노드들을 key 순서대로 나열
+  if (now == t->nil)
+    return idx;
+
+  if (depth == 0) {
+    tasks[idx].node = now;
+    tasks[idx].whole = 1;
+    return idx + 1;
+  }
+
+  idx = split_subtrees(t, now->left, depth - 1, tasks, idx);
+  tasks[idx].node = now;
+  tasks[idx].whole = 0;
+  tasks[idx].len = 1;
+  idx++;
+  return split_subtrees(t, now->right, depth - 1, tasks, idx);
+}
+
+static subtree_task_t *plan_subtrees(const rbtree *t, int nthreads, size_t *n_tasks) {
+  // depth d로 자르면 task는 최대 2^(d+1) - 1개
+  int depth = split_depth(nthreads);
+  subtree_task_t *tasks = (subtree_task_t *)malloc(((size_t)2 << depth) * sizeof(subtree_task_t));
+
+  if (tasks != NULL)
+    *n_tasks = split_subtrees(t, t->root, depth, tasks, 0);
+
+  return tasks;
+}
+
+typedef struct {
+  const rbtree *t;
+  subtree_task_t *tasks;
+  key_t *arr;
+} export_ctx_t;
+
+static void count_subtree_task(void *arg, size_t i) {
+  // 재귀 없이 stack으로 subtree 크기 계산
+  export_ctx_t *ctx = (export_ctx_t *)arg;
+  subtree_task_t *task = &ctx->tasks[i];
+  node_t *stack[RBTREE_MAX_HEIGHT];
+  int top = 0;
+  size_t len = 0;
+
+  if (!task->whole)
+    return;
+
+  stack[top++] = task->node;
+  while (top > 0) {
+    node_t *now = stack[--top];
+    len++;
+    if (now->left != ctx->t->nil)
+      stack[top++] = now->left;
+    if (now->right != ctx->t->nil)
+      stack[top++] = now->right;
+  }
+  task->len = len;
+}
+
+static void export_subtree_task(void *arg, size_t i) {
+  // 재귀 없이 stack으로 중위순회하며 자기 구간에만 기록
+  export_ctx_t *ctx = (export_ctx_t *)arg;
+  subtree_task_t *task = &ctx->tasks[i];
+  node_t *stack[RBTREE_MAX_HEIGHT];
+  int top = 0;
+  node_t *now = task->node;
+  key_t *out = ctx->arr + task->off;
+  size_t idx = 0;
+
+  if (!task->whole) {
+    if (task->len > 0)
+      out[0] = now->key;
+    return;
+  }
+
+  while (idx < task->len && (top > 0 || now != ctx->t->nil)) {
+    while (now != ctx->t->nil) {
+      stack[top++] = now;
+      now = now->left;
+    }
+    now = stack[--top];
+    out[idx++] = now->key;
+    now = now->right;
+  }
+}
+
+int rbtree_to_array_parallel(const rbtree *t, key_t *arr, const size_t n, int nthreads) {
+  if (t->root == t->nil)
+    return -1;
+
+  nthreads = par_threads(nthreads);
+
+  size_t n_tasks = 0;
+  subtree_task_t *tasks = plan_subtrees(t, nthreads, &n_tasks);
+  if (tasks == NULL)
+    return -1;
+
+  export_ctx_t ctx = {t, tasks, arr};
+
+  // 1. subtree 크기를 병렬로 한 번 계산
+  run_parallel(nthreads, n_tasks, count_subtree_task, &ctx);
+
+  // 2. 누적합으로 각 task의 출력 구간을 정하고 n을 넘는 부분은 잘라냄
+  size_t off = 0;
+  for (size_t i = 0; i < n_tasks; i++) {
+    tasks[i].off = off;
+    if (off >= n)
+      tasks[i].len = 0;
+    else if (tasks[i].len > n - off)
+      tasks[i].len = n - off;
+    off += tasks[i].len;
+  }
+
+  // 3. 겹치지 않는 구간에 병렬로 기록
+  run_parallel(nthreads, n_tasks, export_subtree_task, &ctx);
+
+  free(tasks);
+  return 0;
+}
+
+static void free_subtree_task(void *arg, size_t i) {
+  // 전위순회로 자식을 stack에 넣은 뒤 바로 해제
+  export_ctx_t *ctx = (export_ctx_t *)arg;
+  subtree_task_t *task = &ctx->tasks[i];
+  node_t *stack[RBTREE_MAX_HEIGHT];
+  int top = 0;
+
+  if (!task->whole)
+    return;
+
+  stack[top++] = task->node;
+  while (top > 0) {
+    node_t *now = stack[--top];
+    if (now->left != ctx->t->nil)
+      stack[top++] = now->left;
+    if (now->right != ctx->t->nil)
+      stack[top++] = now->right;
+    ctx->t->allocator.free(now, ctx->t->node_size, ctx->t->allocator.ctx);
+  }
+}
+
+void delete_rbtree_parallel(rbtree *t, int nthreads) {
+  size_t n_tasks = 0;
+  subtree_task_t *tasks = NULL;
+
+  nthreads = par_threads(nthreads);
+  if (t->root != t->nil)
+    tasks = plan_subtrees(t, nthreads, &n_tasks);
+
+  // task 배열을 못 만들면 순차 삭제로 대체
+  if (tasks == NULL) {
+    delete_rbtree(t);
+    return;
+  }
+
+  export_ctx_t ctx = {t, tasks, NULL};
+  run_parallel(nthreads, n_tasks, free_subtree_task, &ctx);
+
+  // 위쪽 level의 노드는 subtree 해제가 끝난 뒤 따로 해제
+  for (size_t i = 0; i < n_tasks; i++) {
+    if (!tasks[i].whole)
+      t->allocator.free(tasks[i].node, t->node_size, t->allocator.ctx);
+  }
+
+  free(tasks);
+  rbtree_free_tree(t);
+}
+
+typedef struct {
+  size_t lo, hi;
+  int depth;
+  node_t *parent;
+  node_t **slot;  // 완성된 subtree root를 연결할 위치
+} build_task_t;
+
+typedef struct {
+  rbtree *t;
+  node_t **nodes;
+  const key_t *keys;
+  size_t n;
+  size_t chunk;
+  int red_depth;
+  build_task_t *tasks;
+  size_t n_tasks;
+} build_ctx_t;
+
+static void alloc_chunk_task(void *arg, size_t i) {
+  // 노드 할당과 key 기록을 구간별로 병렬 처리
+  // free list는 thread 간에 공유할 수 없으므로 allocator를 직접 사용
+  build_ctx_t *ctx = (build_ctx_t *)arg;
+  rbtree_allocator_t *allocator = &ctx->t->allocator;
+  size_t lo = i * ctx->chunk;
+  size_t hi = lo + ctx->chunk < ctx->n ? lo + ctx->chunk : ctx->n;
+
+  for (size_t j = lo; j < hi; j++) {
+    ctx->nodes[j] = (node_t *)allocator->alloc(ctx->t->node_size, allocator->ctx);
+    if (ctx->nodes[j] != NULL) {
+      memset(ctx->nodes[j], 0, ctx->t->node_size);
+      ctx->nodes[j]->key = ctx->keys[j];
+    }
+  }
+}
+
+static node_t *build_top(build_ctx_t *ctx, size_t lo, size_t hi, int depth, int split,
+                         node_t *parent, node_t **slot) {
+  // split depth까지는 순차로 연결하고 그 아래는 task로 미룸
+  if (lo >= hi)
+    return ctx->t->nil;
+
+  if (depth == split) {
+    build_task_t *task = &ctx->tasks[ctx->n_tasks++];
+    task->lo = lo;
+    task->hi = hi;
+    task->depth = depth;
+    task->parent = parent;
+    task->slot = slot;
+    return ctx->t->nil;
+  }
+
+  size_t mid = lo + (hi - lo) / 2;
+  node_t *node = ctx->nodes[mid];
+
+  node->parent = parent;
+  node->color = depth >= ctx->red_depth ? RBTREE_RED : RBTREE_BLACK;
+  node->left = build_top(ctx, lo, mid, depth + 1, split, node, &node->left);
+  node->right = build_top(ctx, mid + 1, hi, depth + 1, split, node, &node->right);
+
+  return node;
+}
+
+static void build_subtree_task(void *arg, size_t i) {
+  build_ctx_t *ctx = (build_ctx_t *)arg;
+  build_task_t *task = &ctx->tasks[i];
+
+  *task->slot = build_balanced(ctx->t, ctx->nodes, task->lo, task->hi,
+                               task->depth, ctx->red_depth, task->parent);
+}
+
+rbtree *rbtree_from_sorted(const key_t *keys, const size_t n, int nthreads) {
+  return rbtree_from_sorted_with_allocator(keys, n, nthreads, NULL);
+}
+
+rbtree *rbtree_from_sorted_with_allocator(const key_t *keys, const size_t n, int nthreads,
+                                          const rbtree_allocator_t *allocator) {
+  // keys는 오름차순으로 정렬되어 있어야 함
+  // 노드는 worker에서 allocator로 직접 할당하므로 thread-safe해야 함
+  rbtree *t = new_rbtree_with_allocator(allocator);
+
+  if (t == NULL || n == 0)
+    return t;
+
+  nthreads = par_threads(nthreads);
+
+  int split = split_depth(nthreads);
+  build_ctx_t ctx = {t, NULL, keys, n, 0, full_levels(n), NULL, 0};
+  ctx.nodes = (node_t **)malloc(n * sizeof(node_t *));
+  ctx.tasks = (build_task_t *)malloc(((size_t)1 << split) * sizeof(build_task_t));
+
+  // 1. 노드 할당을 구간별로 병렬 처리
+  size_t n_chunks = (size_t)nthreads * RBTREE_TASKS_PER_THREAD;
+  ctx.chunk = (n + n_chunks - 1) / n_chunks;
+  if (ctx.nodes != NULL)
+    run_parallel(nthreads, (n + ctx.chunk - 1) / ctx.chunk, alloc_chunk_task, &ctx);
+
+  int failed = ctx.nodes == NULL || ctx.tasks == NULL;
+  for (size_t i = 0; !failed && i < n; i++)
+    failed = ctx.nodes[i] == NULL;
+
+  if (failed) {
+    for (size_t i = 0; ctx.nodes != NULL && i < n; i++) {
+      if (ctx.nodes[i] != NULL)
+        t->allocator.free(ctx.nodes[i], t->node_size, t->allocator.ctx);
+    }
+    free(ctx.nodes);
+    free(ctx.tasks);
+    delete_rbtree(t);
+    return NULL;
+  }
+
+  // 2. 위쪽 level을 연결하고 3. 아래쪽 subtree들을 병렬로 연결
+  t->root = build_top(&ctx, 0, n, 0, split, t->nil, &t->root);
+  run_parallel(nthreads, ctx.n_tasks, build_subtree_task, &ctx);
+  t->root->color = RBTREE_BLACK;
+  t->size = n;
+
+  free(ctx.nodes);
+  free(ctx.tasks);
+  return t;
+}
+
+rbtree_memory_t rbtree_memory_usage(const rbtree *t) {
+  // 사용 중: tree 구조체 + nil + 연결된 노드
+  // 예약: free list에 보관 중인 노드
+  rbtree_memory_t usage;
+
+  usage.nodes = t->size;
+  usage.bytes_used = sizeof(rbtree) + sizeof(node_t) + t->size * t->node_size;
+  usage.bytes_reserved = t->n_free * t->node_size;
+
+  return usage;
+}
+
+int rbtree_reserve(rbtree *t, const size_t n) {
+  // 앞으로 n개를 삽입할 때 allocator를 부르지 않도록 free list를 채움
+  while (t->n_free < n) {
+    node_t *node = (node_t *)t->allocator.alloc(t->node_size, t->allocator.ctx);
+    if (node == NULL)
+      return -1;
+    rbtree_release_node(t, node);
+  }
+
+  return 0;
+}
+
+void rbtree_shrink(rbtree *t) {
+  // free list에 보관 중인 노드를 allocator에 전부 반환
+  while (t->free_list != NULL) {
+    node_t *node = t->free_list;
+    t->free_list = node->parent;
+    t->allocator.free(node, t->node_size, t->allocator.ctx);
+  }
+  t->n_free = 0;
+}
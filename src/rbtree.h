@@ -5,31 +5,86 @@
 
 typedef enum { RBTREE_RED, RBTREE_BLACK } color_t;
 
+typedef enum { RBTREE_LEFT, RBTREE_RIGHT } dir_t;
+
 typedef int key_t;
 
+typedef long long agg_t;
+
 typedef struct node_t {
   color_t color;
   key_t key;
-  struct node_t *parent, *left, *right;
+  agg_t agg;  // subtree aggregate (augmentation)
+  struct node_t *parent;
+  union {
+    struct {
+      struct node_t *left, *right;
+    };
+    struct node_t *child[2];  // indexed by dir_t
+  };
 } node_t;
 
+// node with in-order links, allocated only by threaded trees
+typedef struct {
+  node_t node;
+  node_t *prev, *next;
+} link_node_t;
+
+// subtree aggregate: combine must be associative with identity as unit
+typedef struct {
+  agg_t identity;
+  agg_t (*lift)(const node_t *);
+  agg_t (*combine)(const agg_t, const agg_t);
+} rbtree_monoid_t;
+
+extern const rbtree_monoid_t rbtree_monoid_sum;
+extern const rbtree_monoid_t rbtree_monoid_min;
+extern const rbtree_monoid_t rbtree_monoid_max;
+
+// per-tree allocator. must be thread-safe if the parallel APIs are used
+typedef struct {
+  void *(*alloc)(const size_t, void *);
+  void (*free)(void *, const size_t, void *);
+  void *ctx;
+} rbtree_allocator_t;
+
+typedef struct {
+  size_t nodes;
+  size_t bytes_used;
+  size_t bytes_reserved;  // idle nodes kept for reuse
+} rbtree_memory_t;
+
 typedef struct {
   node_t *root;
   node_t *nil;  // for sentinel
+  const rbtree_monoid_t *monoid;  // NULL if not augmented
+  size_t size;
+  rbtree_allocator_t allocator;
+  node_t *free_list;  // linked through parent
+  size_t n_free;
+  size_t node_size;  // sizeof(link_node_t) in threaded mode
+  int threaded;  // keep prev/next links and head/tail up to date
+  node_t *head, *tail;
 } rbtree;
 
 rbtree *new_rbtree(void);
+rbtree *new_rbtree_with_allocator(const rbtree_allocator_t *);
 void delete_rbtree(rbtree *);
 void delete_node(rbtree *, node_t *);
 
 node_t *rbtree_insert(rbtree *, const key_t);
+int rbtree_insert_batch(rbtree *, const key_t *, const size_t);
 void rbtree_insert_fixup(rbtree *, node_t *);
+void rbtree_rotate(rbtree *, node_t *, const dir_t);
 void rbtree_left_rotate(rbtree *, node_t *);
 void rbtree_right_rotate(rbtree *, node_t *);
 node_t *rbtree_find(const rbtree *, const key_t);
 node_t *rbtree_min(const rbtree *);
 node_t *rbtree_successor(const rbtree *, node_t *);
 node_t *rbtree_max(const rbtree *);
+node_t *rbtree_next(const rbtree *, node_t *);
+node_t *rbtree_prev(const rbtree *, node_t *);
+int rbtree_set_threaded(rbtree *, const int);
 int rbtree_erase(rbtree *, node_t *);
 void rbtree_erase_fixup(rbtree *, node_t *);
 void rbtree_transplant(rbtree *, node_t *, node_t *);
@@ -37,4 +92,20 @@ void rbtree_transplant(rbtree *, node_t *, node_t *);
 int rbtree_to_array(const rbtree *, key_t *, const size_t);
 void rbtree_in_order(const rbtree *, node_t *, key_t *, int *);
 
+// nthreads <= 0 uses the number of online cores
+int rbtree_to_array_parallel(const rbtree *, key_t *, const size_t, int);
+void delete_rbtree_parallel(rbtree *, int);
+rbtree *rbtree_from_sorted(const key_t *, const size_t, int);
+rbtree *rbtree_from_sorted_with_allocator(const key_t *, const size_t, int,
+                                          const rbtree_allocator_t *);
+
+void rbtree_set_monoid(rbtree *, const rbtree_monoid_t *);
+void rbtree_augment_node(const rbtree *, node_t *);
+void rbtree_augment_path(const rbtree *, node_t *);
+agg_t rbtree_range_aggregate(const rbtree *, const key_t, const key_t);
+
+rbtree_memory_t rbtree_memory_usage(const rbtree *);
+int rbtree_reserve(rbtree *, const size_t);
+void rbtree_shrink(rbtree *);
+
 #endif  // _RBTREE_H_
\ No newline at end of file
@@ -0,0 +1,589 @@
+#include <pthread.h>
+#include <rbtree.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Differential fuzz harness
+// Runs an operation sequence decoded from bytes against the tree and a
+// sorted-array model, checking the tree invariants after every step.
+// Built with -DRBTREE_LIBFUZZER it exposes LLVMFuzzerTestOneInput,
+// otherwise main() feeds random byte strings and records timings.
+
+#define FAIL(...)                                               \
+  do {                                                          \
+    fprintf(stderr, "fuzz-rbtree: step %zu: ", cur_step);       \
+    fprintf(stderr, __VA_ARGS__);                               \
+    fprintf(stderr, "\n");                                      \
+    abort();                                                    \
+  } while (0)
+
+#define CHECK(cond)                                   \
+  do {                                                \
+    if (!(cond)) FAIL("check failed: %s", #cond);     \
+  } while (0)
+
+static _Thread_local size_t cur_step;
+
+typedef enum {
+  OP_INSERT,
+  OP_ERASE,
+  OP_FIND,
+  OP_BATCH,
+  OP_MINMAX,
+  OP_NEXT,
+  OP_RANGE,
+  OP_TO_ARRAY,
+  OP_TO_ARRAY_PAR,
+  OP_FROM_SORTED,
+  OP_THREADED,
+  OP_RESERVE,
+  OP_SHRINK,
+  N_OPS
+} op_t;
+
+static const char *op_names[N_OPS] = {
+    "insert",     "erase",          "find",        "batch",  "minmax",
+    "next",       "range",          "to_array",    "to_array_par",
+    "from_sorted", "threaded",      "reserve",     "shrink"};
+
+typedef struct {
+  double ns[N_OPS];
+  size_t count[N_OPS];
+} timing_t;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// byte stream the operations are decoded from
+typedef struct {
+  const uint8_t *data;
+  size_t size, pos;
+} input_t;
+
+static bool input_done(const input_t *in) { return in->pos >= in->size; }
+
+static uint8_t next_byte(input_t *in) {
+  return in->pos < in->size ? in->data[in->pos++] : 0;
+}
+
+static key_t next_key(input_t *in) {
+  // mostly a small range so duplicates are common
+  const uint8_t tag = next_byte(in);
+  if (tag & 0x80) {
+    // read in a fixed order so every compiler decodes the same key
+    const uint8_t hi = next_byte(in);
+    const uint8_t lo = next_byte(in);
+    return (key_t)(hi << 8 | lo) - 0x8000;
+  }
+  return tag;
+}
+
+// reference model: sorted array of keys (multiset)
+typedef struct {
+  key_t *keys;
+  size_t n, cap;
+} model_t;
+
+static size_t model_lower(const model_t *m, const key_t key) {
+  size_t lo = 0, hi = m->n;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (m->keys[mid] < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static void model_insert(model_t *m, const key_t key) {
+  if (m->n == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 64;
+    m->keys = realloc(m->keys, m->cap * sizeof(key_t));
+    CHECK(m->keys != NULL);
+  }
+  const size_t pos = model_lower(m, key);
+  memmove(m->keys + pos + 1, m->keys + pos, (m->n - pos) * sizeof(key_t));
+  m->keys[pos] = key;
+  m->n++;
+}
+
+static bool model_erase(model_t *m, const key_t key) {
+  const size_t pos = model_lower(m, key);
+  if (pos == m->n || m->keys[pos] != key) {
+    return false;
+  }
+  memmove(m->keys + pos, m->keys + pos + 1, (m->n - pos - 1) * sizeof(key_t));
+  m->n--;
+  return true;
+}
+
+static agg_t model_sum(const model_t *m, const key_t lo, const key_t hi) {
+  agg_t sum = 0;
+  for (size_t i = model_lower(m, lo); i < m->n && m->keys[i] < hi; i++) {
+    sum += m->keys[i];
+  }
+  return sum;
+}
+
+// thread-safe counting allocator, the parallel APIs call it from workers
+typedef struct {
+  atomic_size_t live_bytes;
+} alloc_stats_t;
+
+static void *counting_alloc(const size_t size, void *ctx) {
+  atomic_fetch_add(&((alloc_stats_t *)ctx)->live_bytes, size);
+  return malloc(size);
+}
+
+static void counting_free(void *ptr, const size_t size, void *ctx) {
+  atomic_fetch_sub(&((alloc_stats_t *)ctx)->live_bytes, size);
+  free(ptr);
+}
+
+// invariants: parent links, BST order, red-red, black height, aggregates,
+// size, in-order equality with the model and the threaded list
+typedef struct {
+  const rbtree *t;
+  const model_t *m;
+  size_t idx;
+} check_ctx_t;
+
+static int check_node(check_ctx_t *c, const node_t *p, const node_t *parent) {
+  const rbtree *t = c->t;
+  if (p == t->nil) {
+    return 1;
+  }
+  CHECK(p->parent == parent);
+  CHECK(p->color == RBTREE_RED || p->color == RBTREE_BLACK);
+  if (p->color == RBTREE_RED) {
+    CHECK(p->left->color == RBTREE_BLACK && p->right->color == RBTREE_BLACK);
+  }
+
+  const int lh = check_node(c, p->left, p);
+  CHECK(c->idx < c->m->n);
+  if (p->key != c->m->keys[c->idx]) {
+    FAIL("in-order key %d at %zu, model has %d", p->key, c->idx,
+         c->m->keys[c->idx]);
+  }
+  c->idx++;
+  const int rh = check_node(c, p->right, p);
+  CHECK(lh == rh);
+
+  if (t->monoid != NULL) {
+    const rbtree_monoid_t *mo = t->monoid;
+    CHECK(p->agg ==
+          mo->combine(mo->combine(p->left->agg, mo->lift(p)), p->right->agg));
+  }
+  return lh + (p->color == RBTREE_BLACK);
+}
+
+static void check_tree(const rbtree *t, const model_t *m,
+                       const alloc_stats_t *stats) {
+  check_ctx_t c = {t, m, 0};
+  CHECK(t->nil->color == RBTREE_BLACK);
+  CHECK(t->root->color == RBTREE_BLACK);
+  check_node(&c, t->root, t->nil);
+  CHECK(c.idx == m->n);
+  CHECK(t->size == m->n);
+
+  if (t->threaded) {
+    size_t i = 0;
+    const node_t *prev = t->nil;
+    CHECK(t->node_size == sizeof(link_node_t));
+    for (const node_t *p = t->head; p != t->nil;
+         p = ((const link_node_t *)p)->next) {
+      CHECK(i < m->n && p->key == m->keys[i]);
+      CHECK(((const link_node_t *)p)->prev == prev);
+      prev = p;
+      i++;
+    }
+    CHECK(i == m->n);
+    CHECK(t->tail == prev);
+  }
+
+  const rbtree_memory_t usage = rbtree_memory_usage(t);
+  CHECK(usage.nodes == m->n);
+  if (stats != NULL) {
+    CHECK(usage.bytes_used + usage.bytes_reserved ==
+          atomic_load(&stats->live_bytes));
+  }
+}
+
+static void configure_tree(rbtree *t, const uint8_t config) {
+  CHECK(t != NULL);
+  if (config & 1) {
+    rbtree_set_monoid(t, &rbtree_monoid_sum);
+  }
+  CHECK(rbtree_set_threaded(t, config & 2) == 0);
+}
+
+static void run_ops(const uint8_t *data, const size_t size, timing_t *timing) {
+  input_t in = {data, size, 0};
+  model_t m = {NULL, 0, 0};
+  alloc_stats_t stats;
+  atomic_init(&stats.live_bytes, 0);
+
+  // first byte: bit0 sum monoid, bit1 threaded, bit2 counting allocator
+  const uint8_t config = next_byte(&in);
+  const rbtree_allocator_t counting = {counting_alloc, counting_free, &stats};
+  const rbtree_allocator_t *allocator = (config & 4) ? &counting : NULL;
+  const alloc_stats_t *check_stats = (config & 4) ? &stats : NULL;
+  rbtree *t = new_rbtree_with_allocator(allocator);
+  configure_tree(t, config);
+  key_t *buf = NULL;
+  size_t buf_cap = 0;
+
+  for (cur_step = 0; !input_done(&in); cur_step++) {
+    const op_t op = (op_t)(next_byte(&in) % N_OPS);
+    double start = 0;
+
+    // make sure the scratch buffer can hold the whole tree plus a batch
+    if (buf_cap < m.n + 256) {
+      buf_cap = (m.n + 256) * 2;
+      buf = realloc(buf, buf_cap * sizeof(key_t));
+      CHECK(buf != NULL);
+    }
+
+    switch (op) {
+      case OP_INSERT: {
+        const key_t key = next_key(&in);
+        start = now_ns();
+        node_t *p = rbtree_insert(t, key);
+        timing->ns[op] += now_ns() - start;
+        CHECK(p != NULL && p->key == key);
+        model_insert(&m, key);
+        break;
+      }
+      case OP_ERASE: {
+        const key_t key = next_key(&in);
+        start = now_ns();
+        node_t *p = rbtree_find(t, key);
+        if (p != NULL) {
+          rbtree_erase(t, p);
+        }
+        timing->ns[op] += now_ns() - start;
+        CHECK((p != NULL) == model_erase(&m, key));
+        break;
+      }
+      case OP_FIND: {
+        const key_t key = next_key(&in);
+        start = now_ns();
+        node_t *p = rbtree_find(t, key);
+        timing->ns[op] += now_ns() - start;
+        const size_t pos = model_lower(&m, key);
+        CHECK((p != NULL) == (pos < m.n && m.keys[pos] == key));
+        CHECK(p == NULL || p->key == key);
+        break;
+      }
+      case OP_BATCH: {
+        // keep batches short so they do not eat the whole input
+        const size_t n = next_byte(&in) % 64;
+        for (size_t i = 0; i < n; i++) {
+          buf[i] = next_key(&in);
+        }
+        start = now_ns();
+        CHECK(rbtree_insert_batch(t, buf, n) == 0);
+        timing->ns[op] += now_ns() - start;
+        for (size_t i = 0; i < n; i++) {
+          model_insert(&m, buf[i]);
+        }
+        break;
+      }
+      case OP_MINMAX: {
+        if (m.n == 0) {
+          continue;
+        }
+        start = now_ns();
+        node_t *lo = rbtree_min(t);
+        node_t *hi = rbtree_max(t);
+        timing->ns[op] += now_ns() - start;
+        CHECK(lo->key == m.keys[0]);
+        CHECK(hi->key == m.keys[m.n - 1]);
+        break;
+      }
+      case OP_NEXT: {
+        // walk a few steps forward from a key, then back again
+        const key_t key = next_key(&in);
+        const size_t steps = next_byte(&in) % 32;
+        node_t *p = rbtree_find(t, key);
+        if (p == NULL) {
+          continue;
+        }
+        size_t pos = model_lower(&m, key);
+        // find may return any of the duplicates, align the model index
+        while (rbtree_prev(t, p) != NULL && rbtree_prev(t, p)->key == key) {
+          p = rbtree_prev(t, p);
+        }
+        start = now_ns();
+        size_t i = 0;
+        for (; i < steps && p != NULL; i++) {
+          CHECK(pos + i < m.n && p->key == m.keys[pos + i]);
+          p = rbtree_next(t, p);
+        }
+        timing->ns[op] += now_ns() - start;
+        CHECK(p != NULL || pos + i == m.n);
+        break;
+      }
+      case OP_RANGE: {
+        if (t->monoid == NULL) {
+          continue;
+        }
+        const key_t lo = next_key(&in);
+        const key_t hi = lo + next_byte(&in);
+        start = now_ns();
+        const agg_t sum = rbtree_range_aggregate(t, lo, hi);
+        timing->ns[op] += now_ns() - start;
+        CHECK(sum == model_sum(&m, lo, hi));
+        break;
+      }
+      case OP_TO_ARRAY:
+      case OP_TO_ARRAY_PAR: {
+        if (m.n == 0) {
+          continue;
+        }
+        // sometimes ask for a prefix only
+        const size_t n = (next_byte(&in) & 1) ? m.n : m.n / 2 + 1;
+        const int nthreads = next_byte(&in) % 4 + 1;
+        buf[n] = -1;
+        start = now_ns();
+        if (op == OP_TO_ARRAY) {
+          rbtree_to_array(t, buf, m.n);
+        } else {
+          CHECK(rbtree_to_array_parallel(t, buf, n, nthreads) == 0);
+        }
+        timing->ns[op] += now_ns() - start;
+        const size_t upto = op == OP_TO_ARRAY ? m.n : n;
+        CHECK(memcmp(buf, m.keys, upto * sizeof(key_t)) == 0);
+        CHECK(op == OP_TO_ARRAY || n == m.n || buf[n] == -1);
+        break;
+      }
+      case OP_FROM_SORTED: {
+        // replace the tree with a parallel rebuild of the model
+        const int nthreads = next_byte(&in) % 4 + 1;
+        start = now_ns();
+        delete_rbtree_parallel(t, nthreads);
+        t = rbtree_from_sorted_with_allocator(m.keys, m.n, nthreads, allocator);
+        timing->ns[op] += now_ns() - start;
+        configure_tree(t, config);
+        break;
+      }
+      case OP_THREADED: {
+        const int on = next_byte(&in) & 1;
+        start = now_ns();
+        CHECK(rbtree_set_threaded(t, on) == 0);
+        timing->ns[op] += now_ns() - start;
+        break;
+      }
+      case OP_RESERVE: {
+        const size_t n = next_byte(&in);
+        start = now_ns();
+        CHECK(rbtree_reserve(t, n) == 0);
+        timing->ns[op] += now_ns() - start;
+        CHECK(rbtree_memory_usage(t).bytes_reserved >= n * sizeof(node_t));
+        break;
+      }
+      case OP_SHRINK: {
+        start = now_ns();
+        rbtree_shrink(t);
+        timing->ns[op] += now_ns() - start;
+        CHECK(rbtree_memory_usage(t).bytes_reserved == 0);
+        break;
+      }
+      default:
+        FAIL("unknown op %d", op);
+    }
+    timing->count[op]++;
+
+    check_tree(t, &m, check_stats);
+  }
+
+  delete_rbtree(t);
+  if (config & 4) {
+    CHECK(atomic_load(&stats.live_bytes) == 0);
+  }
+  free(buf);
+  free(m.keys);
+}
+
+#ifdef RBTREE_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  timing_t timing;
+  memset(&timing, 0, sizeof(timing));
+  run_ops(data, size, &timing);
+  return 0;
+}
+
+#else
+
+typedef struct {
+  unsigned int seed;
+  size_t iters, ops;
+  bool spawned;
+  timing_t timing;
+} worker_t;
+
+static uint32_t xorshift(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static void *run_worker(void *arg) {
+  worker_t *w = (worker_t *)arg;
+  // about 3 bytes per op on average
+  const size_t size = w->ops * 3;
+  uint8_t *data = malloc(size);
+
+  for (size_t i = 0; i < w->iters; i++) {
+    uint32_t state = (w->seed + (uint32_t)i) * 2654435761u | 1;
+    for (size_t j = 0; j < size; j++) {
+      data[j] = (uint8_t)xorshift(&state);
+    }
+    run_ops(data, size, &w->timing);
+  }
+  free(data);
+  return NULL;
+}
+
+// baseline file: one "<op> <ns per op>" line per operation
+static bool load_baseline(const char *path, double *base) {
+  FILE *fp = fopen(path, "r");
+  char name[64];
+  double ns;
+  if (fp == NULL) {
+    return false;
+  }
+  while (fscanf(fp, "%63s %lf", name, &ns) == 2) {
+    for (int op = 0; op < N_OPS; op++) {
+      if (strcmp(name, op_names[op]) == 0) {
+        base[op] = ns;
+      }
+    }
+  }
+  fclose(fp);
+  return true;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-seed S] [-iters N] [-ops N] [-threads N]\n"
+          "          [-baseline FILE] [-record FILE] [-slowdown F] [-strict]\n",
+          prog);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int seed = 17;
+  size_t iters = 50, ops = 2000;
+  int threads = 1;
+  const char *baseline = NULL, *record = NULL;
+  double slowdown = 2.0;
+  bool strict = false;
+
+  for (int i = 1; i < argc; i++) {
+    const bool has_arg = i + 1 < argc;
+    if (strcmp(argv[i], "-seed") == 0 && has_arg) {
+      seed = (unsigned int)strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-iters") == 0 && has_arg) {
+      iters = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-ops") == 0 && has_arg) {
+      ops = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-threads") == 0 && has_arg) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-baseline") == 0 && has_arg) {
+      baseline = argv[++i];
+    } else if (strcmp(argv[i], "-record") == 0 && has_arg) {
+      record = argv[++i];
+    } else if (strcmp(argv[i], "-slowdown") == 0 && has_arg) {
+      slowdown = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-strict") == 0) {
+      strict = true;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  // stress mode: every thread runs its own sequences at the same time,
+  // while the parallel ops inside spawn workers of their own
+  worker_t *workers = calloc(threads, sizeof(worker_t));
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+  for (int i = 0; i < threads; i++) {
+    workers[i].seed = seed + (unsigned int)i * 7919;
+    workers[i].iters = (iters + threads - 1) / threads;
+    workers[i].ops = ops;
+    workers[i].spawned =
+        pthread_create(&tids[i], NULL, run_worker, &workers[i]) == 0;
+    if (!workers[i].spawned) {
+      run_worker(&workers[i]);
+    }
+  }
+
+  timing_t total;
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < threads; i++) {
+    if (workers[i].spawned) {
+      pthread_join(tids[i], NULL);
+    }
+    for (int op = 0; op < N_OPS; op++) {
+      total.ns[op] += workers[i].timing.ns[op];
+      total.count[op] += workers[i].timing.count[op];
+    }
+  }
+
+  double base[N_OPS] = {0};
+  if (baseline != NULL && !load_baseline(baseline, base)) {
+    fprintf(stderr, "cannot read baseline %s\n", baseline);
+    return 2;
+  }
+
+  FILE *rec = NULL;
+  if (record != NULL && (rec = fopen(record, "w")) == NULL) {
+    fprintf(stderr, "cannot write %s\n", record);
+    return 2;
+  }
+
+  int slow = 0;
+  printf("%-14s %10s %12s %12s\n", "op", "count", "ns/op", "baseline");
+  for (int op = 0; op < N_OPS; op++) {
+    if (total.count[op] == 0) {
+      continue;
+    }
+    const double per_op = total.ns[op] / total.count[op];
+    const bool flagged = base[op] > 0 && per_op > base[op] * slowdown;
+    printf("%-14s %10zu %12.1f %12.1f%s\n", op_names[op], total.count[op],
+           per_op, base[op], flagged ? "  SLOW" : "");
+    slow += flagged;
+    if (rec != NULL) {
+      fprintf(rec, "%s %.1f\n", op_names[op], per_op);
+    }
+  }
+  if (rec != NULL) {
+    fclose(rec);
+  }
+
+  const size_t runs = workers[0].iters * threads;
+  free(tids);
+  free(workers);
+
+  printf("Passed %zu fuzz sequences on %d thread(s)", runs, threads);
+  printf(slow ? ", %d op(s) slower than baseline\n" : "\n", slow);
+  return strict && slow ? 1 : 0;
+}
+
+#endif  // RBTREE_LIBFUZZER
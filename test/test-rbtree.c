@@ -366,8 +366,370 @@ void test_find_erase_rand(const size_t n, const unsigned int seed) {
   delete_rbtree(t);
 }
 
+// range aggregate should match a linear scan over the keys in [lo, hi)
+static agg_t naive_aggregate(const rbtree_monoid_t *m, const key_t *arr,
+                             const size_t n, const key_t lo, const key_t hi) {
+  agg_t res = m->identity;
+  for (size_t i = 0; i < n; i++) {
+    if (arr[i] >= lo && arr[i] < hi) {
+      res = m->combine(res, arr[i]);
+    }
+  }
+  return res;
+}
+
+void test_range_aggregate(const rbtree_monoid_t *m, const size_t n,
+                          const unsigned int seed) {
+  srand(seed);
+  rbtree *t = new_rbtree();
+  assert(t != NULL);
+  rbtree_set_monoid(t, m);
+
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand() % 1000;
+    rbtree_insert(t, arr[i]);
+  }
+
+  // erase half of the keys to exercise the erase path
+  for (size_t i = 0; i < n / 2; i++) {
+    node_t *p = rbtree_find(t, arr[i]);
+    assert(p != NULL);
+    rbtree_erase(t, p);
+  }
+  const key_t *rest = arr + n / 2;
+  const size_t m_n = n - n / 2;
+
+  test_color_constraint(t);
+  test_search_constraint(t);
+  assert(t->root->agg == naive_aggregate(m, rest, m_n, -1, 1000));
+
+  for (int i = 0; i < 100; i++) {
+    key_t lo = rand() % 1100 - 50;
+    key_t hi = lo + rand() % 500;
+    assert(rbtree_range_aggregate(t, lo, hi) ==
+           naive_aggregate(m, rest, m_n, lo, hi));
+  }
+
+  free(arr);
+  delete_rbtree(t);
+}
+
+void test_range_aggregate_suite() {
+  test_range_aggregate(&rbtree_monoid_sum, 1000, 19);
+  test_range_aggregate(&rbtree_monoid_min, 1000, 23);
+  test_range_aggregate(&rbtree_monoid_max, 1000, 29);
+}
+
+// batch insert should end in a valid tree holding every key
+void test_insert_batch(const size_t base, const size_t n,
+                       const unsigned int seed) {
+  srand(seed);
+  rbtree *t = new_rbtree();
+  assert(t != NULL);
+  rbtree_set_monoid(t, &rbtree_monoid_sum);
+
+  key_t *arr = calloc(base + n, sizeof(key_t));
+  for (size_t i = 0; i < base + n; i++) {
+    arr[i] = rand() % 5000;
+  }
+  insert_arr(t, arr, base);
+  assert(rbtree_insert_batch(t, arr + base, n) == 0);
+  assert(t->size == base + n);
+
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  qsort((void *)arr, base + n, sizeof(key_t), comp);
+  key_t *res = calloc(base + n, sizeof(key_t));
+  rbtree_to_array(t, res, base + n);
+  agg_t sum = 0;
+  for (size_t i = 0; i < base + n; i++) {
+    assert(arr[i] == res[i]);
+    sum += arr[i];
+  }
+  assert(t->root->agg == sum);
+
+  free(res);
+  free(arr);
+  delete_rbtree(t);
+}
+
+void test_insert_batch_suite() {
+  // empty tree, large batch (rebuild) and small batch (per-key insert)
+  test_insert_batch(0, 1000, 31);
+  test_insert_batch(1000, 1000, 37);
+  test_insert_batch(10000, 10, 41);
+}
+
+// parallel export, build and teardown should match the sequential ones
+void test_parallel(const size_t n, const int nthreads,
+                   const unsigned int seed) {
+  srand(seed);
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand();
+  }
+
+  rbtree *t = new_rbtree();
+  assert(t != NULL);
+  insert_arr(t, arr, n);
+  qsort((void *)arr, n, sizeof(key_t), comp);
+
+  key_t *res = calloc(n, sizeof(key_t));
+  assert(rbtree_to_array_parallel(t, res, n, nthreads) == 0);
+  for (size_t i = 0; i < n; i++) {
+    assert(arr[i] == res[i]);
+  }
+
+  // output should be truncated to the given size
+  const size_t half = n / 2;
+  res[half] = -1;
+  assert(rbtree_to_array_parallel(t, res, half, nthreads) == 0);
+  assert(res[half] == -1);
+  assert(res[half - 1] == arr[half - 1]);
+  delete_rbtree_parallel(t, nthreads);
+
+  rbtree *u = rbtree_from_sorted(arr, n, nthreads);
+  assert(u != NULL);
+  assert(u->size == n);
+  test_color_constraint(u);
+  test_search_constraint(u);
+  rbtree_to_array(u, res, n);
+  for (size_t i = 0; i < n; i++) {
+    assert(arr[i] == res[i]);
+  }
+  delete_rbtree_parallel(u, nthreads);
+
+  free(res);
+  free(arr);
+}
+
+void test_parallel_suite() {
+  test_parallel(100000, 4, 43);
+  test_parallel(10, 8, 47);
+  test_parallel(1000, 0, 53);
+}
+
+// counting allocator to check that every node goes through the hooks
+typedef struct {
+  size_t allocs, frees, live_bytes;
+} alloc_stats_t;
+
+static void *counting_alloc(const size_t size, void *ctx) {
+  alloc_stats_t *stats = (alloc_stats_t *)ctx;
+  stats->allocs++;
+  stats->live_bytes += size;
+  return malloc(size);
+}
+
+static void counting_free(void *ptr, const size_t size, void *ctx) {
+  alloc_stats_t *stats = (alloc_stats_t *)ctx;
+  stats->frees++;
+  stats->live_bytes -= size;
+  free(ptr);
+}
+
+void test_memory_accounting(const size_t n) {
+  alloc_stats_t stats = {0, 0, 0};
+  const rbtree_allocator_t allocator = {counting_alloc, counting_free, &stats};
+  rbtree *t = new_rbtree_with_allocator(&allocator);
+  assert(t != NULL);
+
+  // reserve should preallocate so inserts do not call the allocator
+  assert(rbtree_reserve(t, n) == 0);
+  const size_t reserved_allocs = stats.allocs;
+  rbtree_memory_t usage = rbtree_memory_usage(t);
+  assert(usage.nodes == 0);
+  assert(usage.bytes_reserved == n * sizeof(node_t));
+
+  for (size_t i = 0; i < n; i++) {
+    rbtree_insert(t, (key_t)i);
+  }
+  assert(stats.allocs == reserved_allocs);
+  usage = rbtree_memory_usage(t);
+  assert(usage.nodes == n);
+  assert(usage.bytes_reserved == 0);
+  assert(usage.bytes_used == stats.live_bytes);
+
+  // erased nodes are kept until shrink
+  for (size_t i = 0; i < n / 2; i++) {
+    rbtree_erase(t, rbtree_find(t, (key_t)i));
+  }
+  usage = rbtree_memory_usage(t);
+  assert(usage.nodes == n - n / 2);
+  assert(usage.bytes_reserved == (n / 2) * sizeof(node_t));
+  assert(usage.bytes_used + usage.bytes_reserved == stats.live_bytes);
+
+  rbtree_shrink(t);
+  usage = rbtree_memory_usage(t);
+  assert(usage.bytes_reserved == 0);
+  assert(usage.bytes_used == stats.live_bytes);
+
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  delete_rbtree(t);
+  assert(stats.allocs == stats.frees);
+  assert(stats.live_bytes == 0);
+
+  // a restored tree should live in the same allocator
+  // (single thread: the counting allocator is not thread-safe)
+  key_t *keys = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = (key_t)i;
+  }
+  t = rbtree_from_sorted_with_allocator(keys, n, 1, &allocator);
+  assert(t != NULL);
+  usage = rbtree_memory_usage(t);
+  assert(usage.nodes == n);
+  assert(usage.bytes_used == stats.live_bytes);
+  delete_rbtree(t);
+  assert(stats.allocs == stats.frees);
+  assert(stats.live_bytes == 0);
+  free(keys);
+}
+
+// threaded links should follow the key order through inserts and erases
+static void check_threaded(const rbtree *t, const key_t *sorted,
+                           const size_t n) {
+  key_t *res = calloc(n + 1, sizeof(key_t));
+  assert(rbtree_to_array(t, res, n) == 0 || n == 0);
+  for (size_t i = 0; i < n; i++) {
+    assert(res[i] == sorted[i]);
+  }
+
+  // walk backward from the max with prev
+  size_t i = n;
+  for (node_t *p = n == 0 ? NULL : rbtree_max(t); p != NULL;
+       p = rbtree_prev(t, p)) {
+    assert(i > 0);
+    assert(p->key == sorted[--i]);
+  }
+  assert(i == 0);
+  free(res);
+}
+
+void test_threaded(const size_t n, const unsigned int seed) {
+  srand(seed);
+  rbtree *t = new_rbtree();
+  assert(t != NULL);
+
+  key_t *arr = calloc(2 * n, sizeof(key_t));
+  for (size_t i = 0; i < 2 * n; i++) {
+    arr[i] = rand() % 1000;
+  }
+
+  // turn threading on after some inserts
+  insert_arr(t, arr, n / 2);
+  assert(rbtree_memory_usage(t).bytes_used ==
+         sizeof(rbtree) + (n / 2 + 1) * sizeof(node_t));
+  assert(rbtree_set_threaded(t, 1) == 0);
+  test_color_constraint(t);
+  test_search_constraint(t);
+  insert_arr(t, arr + n / 2, n - n / 2);
+
+  // only threaded trees pay for the links
+  assert(rbtree_memory_usage(t).bytes_used ==
+         sizeof(rbtree) + sizeof(node_t) + n * sizeof(link_node_t));
+
+  // erase every other key
+  for (size_t i = 0; i < n; i += 2) {
+    rbtree_erase(t, rbtree_find(t, arr[i]));
+  }
+  size_t m = 0;
+  for (size_t i = 1; i < n; i += 2) {
+    arr[m++] = arr[i];
+  }
+  qsort((void *)arr, m, sizeof(key_t), comp);
+  test_color_constraint(t);
+  test_search_constraint(t);
+  check_threaded(t, arr, m);
+
+  // the batch rebuild path should relink the whole list
+  for (size_t i = 0; i < n; i++) {
+    arr[m + i] = arr[n + i];
+  }
+  assert(rbtree_insert_batch(t, arr + m, n) == 0);
+  qsort((void *)arr, m + n, sizeof(key_t), comp);
+  check_threaded(t, arr, m + n);
+
+  // non-threaded next should agree after turning it off
+  assert(rbtree_set_threaded(t, 0) == 0);
+  assert(rbtree_memory_usage(t).bytes_used ==
+         sizeof(rbtree) + (m + n + 1) * sizeof(node_t));
+  test_color_constraint(t);
+  test_search_constraint(t);
+  size_t i = 0;
+  for (node_t *p = rbtree_min(t); p != NULL; p = rbtree_next(t, p)) {
+    assert(p->key == arr[i++]);
+  }
+  assert(i == m + n);
+
+  free(arr);
+  delete_rbtree(t);
+}
+
+// allocator that fails after a fixed number of allocations
+typedef struct {
+  size_t left, live;
+} failing_stats_t;
+
+static void *failing_alloc(const size_t size, void *ctx) {
+  failing_stats_t *stats = (failing_stats_t *)ctx;
+  if (stats->left == 0) {
+    return NULL;
+  }
+  stats->left--;
+  stats->live++;
+  return malloc(size);
+}
+
+static void failing_free(void *ptr, const size_t size, void *ctx) {
+  ((failing_stats_t *)ctx)->live--;
+  free(ptr);
+}
+
+// batch insert should fail up front instead of dropping keys on OOM
+void test_insert_batch_oom(const size_t base, const size_t n) {
+  // room for the tree struct, nil and base nodes, then a few more
+  failing_stats_t stats = {2 + base + n / 2, 0};
+  const rbtree_allocator_t allocator = {failing_alloc, failing_free, &stats};
+  rbtree *t = new_rbtree_with_allocator(&allocator);
+  assert(t != NULL);
+
+  for (size_t i = 0; i < base; i++) {
+    assert(rbtree_insert(t, (key_t)i) != NULL);
+  }
+
+  key_t *arr = calloc(base, sizeof(key_t));
+  for (size_t i = 0; i < base; i++) {
+    arr[i] = (key_t)(base + i);
+  }
+  // small batch takes the per-key path, large one the rebuild path
+  assert(rbtree_insert_batch(t, arr, n) == -1);
+  assert(t->size == base);
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  stats.left = base / 2;
+  assert(rbtree_insert_batch(t, arr, base) == -1);
+  assert(t->size == base);
+
+  // with enough memory both succeed and keep every key
+  stats.left = (size_t)-1;
+  assert(rbtree_insert_batch(t, arr, n) == 0);
+  assert(t->size == base + n);
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  free(arr);
+  delete_rbtree(t);
+  assert(stats.live == 0);
+}
+
 int main(void) {
-  printf("\n-----11가지 테스트-----\n");
+  printf("\n-----17가지 테스트-----\n");
   test_init();
   printf("1. test_init() completed\n");
   test_insert_single(1024);
@@ -390,6 +752,18 @@ int main(void) {
   printf("10. test_multi_instance() completed\n");
   test_find_erase_rand(10000, 17);
   printf("11. test_find_erase_rand() completed\n");
+  test_range_aggregate_suite();
+  printf("12. test_range_aggregate_suite() completed\n");
+  test_insert_batch_suite();
+  printf("13. test_insert_batch_suite() completed\n");
+  test_parallel_suite();
+  printf("14. test_parallel_suite() completed\n");
+  test_memory_accounting(1000);
+  printf("15. test_memory_accounting() completed\n");
+  test_threaded(2000, 59);
+  printf("16. test_threaded() completed\n");
+  test_insert_batch_oom(1000, 10);
+  printf("17. test_insert_batch_oom() completed\n");
   printf("Passed all tests!\n");
 
   return 0;